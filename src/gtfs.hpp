@@ -18,8 +18,26 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <iomanip>
 #include <unordered_set>
+#include <set>
+#include <list>
+#include <climits>
+#include <unordered_map>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <future>
+#include <functional>
+#include <sys/uio.h>
+#include <deque>
+#include <string_view>
 
 using namespace std;
 
@@ -30,92 +48,648 @@ using namespace std;
 
 #define MAX_FILENAME_LEN 255
 #define MAX_NUM_FILES_PER_DIR 1024
+#define MAX_CACHED_CLOSED_FDS 64  // Descriptors kept open for files in closed_files
+#define OVERLAY_INLINE 32      // Overlapping writes a read can overlay without allocating
+#define CACHE_BLOCK_BYTES 4096     // Unit of the block cache
+#define CACHE_MAX_READ_BLOCKS 256  // Reads spanning more blocks bypass the block cache
+
+// Read-ahead: READAHEAD_TRIGGER reads in a row that each start where the last one ended make
+// a stream, which is prefetched ahead of the reader in a window that doubles from
+// READAHEAD_MIN_BYTES up to READAHEAD_MAX_BYTES. READAHEAD_TRIGGER reads elsewhere in a row
+// switch the file to random access.
+#define READAHEAD_TRIGGER 2
+#define READAHEAD_MIN_BYTES (128 * 1024)
+#define READAHEAD_MAX_BYTES (8 * 1024 * 1024)
+
+// Write allocation: write_t objects come from slabs, payloads up to WRITE_INLINE_BYTES live
+// inside the write_t and larger ones come from power-of-two size classes up to 64 KiB.
+#define WRITE_INLINE_BYTES 64
+#define WRITE_SLAB_SLOTS 256
+#define PAYLOAD_MIN_CLASS_SHIFT 7      // Smallest class is 128 bytes
+#define PAYLOAD_NUM_CLASSES 10         // Largest class is 64 KiB
+#define PAYLOAD_CHUNK_BYTES (256 * 1024)
+#define WRITE_PAYLOAD_INLINE -1
+#define WRITE_PAYLOAD_HEAP -2          // Allocated with new[] (large or caller-owned buffers)
 
 extern int do_verbose;
 
+// How far a commit is pushed before the caller is released. Set for the whole
+// gtfs_t in gtfs_init and optionally overridden per file in gtfs_open_file.
+typedef enum gtfs_durability {
+    GTFS_SYNC_DEFAULT = -1,   // Inherit the gtfs_t policy (files only)
+    GTFS_SYNC_NONE = 0,       // Leave records buffered, never sync
+    GTFS_SYNC_FLUSH,          // Hand data to the kernel (page cache) only
+    GTFS_SYNC_FDATASYNC,      // fdatasync at every commit
+    GTFS_SYNC_DSYNC,          // Log and data descriptors opened with O_DSYNC
+} gtfs_durability_t;
+
+// How data-file and log I/O is issued (gtfs_set_io_engine)
+typedef enum gtfs_io_engine {
+    GTFS_IO_BLOCKING = 0,     // One syscall at a time on the calling thread
+    GTFS_IO_URING,            // Batched, linked submissions on an io_uring (Linux 5.6+)
+    GTFS_IO_THREADS,          // Independent chains of operations fan out to worker threads
+} gtfs_io_engine_t;
+
+#define IO_DEFAULT_DEPTH 64       // Ring entries, or worker threads (up to IO_MAX_WORKERS)
+#define IO_MAX_WORKERS 16
+
+// Flags for gtfs_open_file
+#define GTFS_OPEN_MMAP 0x1        // Map the data file; reads and syncs go through the mapping
+#define GTFS_OPEN_COALESCE 0x2    // Merge overlapping writes that are synced together (see API notes)
+#define GTFS_OPEN_PREALLOCATE 0x4 // Reserve blocks for the whole file instead of leaving new space sparse
+
 typedef struct gtfs gtfs_t;
 typedef struct file file_t;
 typedef struct write write_t;
+struct io_engine;
+
+// File offsets, lengths and byte counts. Files and single writes may exceed 2 GB.
+typedef int64_t gtfs_off_t;
+
+// Most bytes a single read or write system call (or io_uring request) moves. Larger reads
+// and writes of data files are issued as a series of chunks.
+#define GTFS_IO_CHUNK (64 * 1024 * 1024)
 
 typedef struct log_entry {
     char action;     // "BEGIN", "COMMIT", "ABORT", "WRITE"
     int write_id;      // Unique write ID
     string filename;
-    int offset;
-    int length;
+    gtfs_off_t offset;
+    gtfs_off_t length;
     string data;       // Data (may contain any characters)
+    const char *payload = NULL;  // When set, logged instead of data without being copied
 } log_entry_t;
 
+// On-disk log record: a fixed header followed by the filename and the raw payload.
+// The CRC covers the header (with crc set to 0), the filename and the payload.
+// A 'V' record (gtfs_writev) logs length ranges as write_id, write_id + 1, ...: its payload
+// holds each range as an int64_t offset, an int64_t length and the bytes.
+#define LOG_RECORD_MAGIC 0x53465447u   // "GTFS" in little endian
+#define LOG_RECORD_VERSION 2
+
+typedef struct __attribute__((packed)) log_record_header {
+    uint32_t magic;
+    uint8_t type;          // 'W', 'V', 'S', 'A', 'R' or 'C' (checkpoint)
+    uint8_t version;
+    uint16_t name_len;     // Bytes of filename following the header
+    int32_t write_id;
+    uint64_t payload_len;  // Bytes of payload following the filename
+    int64_t offset;
+    int64_t length;
+    uint32_t crc;
+} log_record_header_t;
+
+// Version 1 header, still read during recovery: the same fields with a 32-bit payload_len
+typedef struct __attribute__((packed)) log_record_header_v1 {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t version;
+    uint16_t name_len;
+    int32_t write_id;
+    uint32_t payload_len;
+    int64_t offset;
+    int64_t length;
+    uint32_t crc;
+} log_record_header_v1_t;
+
+// Segmented log (gtfs_set_log_segments): records go to preallocated segment files
+// gtfs_log.000001, gtfs_log.000002, ... written in place rather than appended. A record's CRC
+// is extended over the number of its segment, so whatever a recycled segment held in its
+// previous life reads as the end of the segment. gtfs_log.manifest names the first live
+// segment; older ones are kept for reuse or unlinked.
+#define LOG_MANIFEST_MAGIC 0x4d465447u   // "GTFM" in little endian
+#define LOG_SEGMENT_MIN_BYTES (64 * 1024)
+#define LOG_SEGMENTS_KEPT 4              // Retired segments kept around for recycling
+
+typedef struct __attribute__((packed)) log_manifest {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment_bytes;
+    uint32_t first_segment;
+    uint32_t crc;          // Over the manifest with crc set to 0
+} log_manifest_t;
+
+// Log sequence number: position of a record in the log. Each gtfs_init reserves the next
+// LSN_RANGE numbers in gtfs_log.lsn and counts on from the start of them, so LSNs keep
+// growing across restarts.
+typedef uint64_t gtfs_lsn_t;
+#define LSN_RANGE (1ull << 40)
+
+// Applied markers: every data file has a sidecar APPLIED_DIR/<filename> holding the LSN of
+// the last 'S' record whose write is known to be durable in it. 'S' records carry their
+// LSN as an 8-byte payload, and recovery skips the synced writes a marker already covers.
+// A marker is rewritten after each sync of a GTFS_SYNC_FDATASYNC or GTFS_SYNC_DSYNC file,
+// and by gtfs_checkpoint for files below that. It also names the inode and size of the data
+// file it was written for, so a data file replaced or resized since is replayed in full.
+#define APPLIED_DIR ".gtfs_applied"
+
+// Applied markers and gtfs_log.lsn (where ino and size are 0)
+typedef struct __attribute__((packed)) lsn_marker {
+    uint64_t lsn;
+    uint64_t ino;
+    int64_t size;
+    uint32_t crc;          // Over the marker with crc set to 0
+} lsn_marker_t;
+
+// One record of a mapped log. name and payload point into the mapping.
+typedef struct log_record_view {
+    log_record_header_t hdr;
+    const char *name;
+    const char *payload;
+} log_record_view_t;
+
+// Reads a log file front to back through a read-only mapping, checking each record's bounds
+// and CRC in place. Nothing is copied or allocated per record, and views stay valid for as
+// long as the reader lives.
+struct log_reader {
+    const char *base = NULL;
+    size_t length = 0;
+    size_t pos = 0;           // Just past the last good record
+    uint32_t segment = 0;     // Segment number the CRCs are salted with, 0 for the single-file log
+
+    log_reader() = default;
+    log_reader(const log_reader &) = delete;
+    log_reader& operator=(const log_reader &) = delete;
+    int open(const string &path, uint32_t segment_number);
+    // A log written in the legacy ASCII-bit format, which only read_log_entry parses
+    bool legacy() const { return length > 0 && (base[0] == '0' || base[0] == '1' || base[0] == '\n'); }
+    // 1 with view filled in, 0 at the end of the log, -1 at a torn or corrupt record
+    int next(log_record_view_t &view);
+    ~log_reader();
+};
+
+// Crash recovery runs in two phases. A scan of the log indexes every write by id and keeps
+// the ones that were synced, in log order per data file. The synced writes are then laid
+// down again with data files spread across up to RECOVERY_MAX_THREADS threads.
+#define RECOVERY_MAX_THREADS 8
+
+// filename and data point into a mapped log, or into recovery_index_t::decoded
+typedef struct recovered_write {
+    string_view filename;
+    gtfs_off_t offset;
+    gtfs_off_t length;
+    const char *data;
+    gtfs_lsn_t lsn = 0;    // From its 'S' record, 0 if the record predates LSNs
+} recovered_write_t;
+
+typedef struct recovered_file {
+    vector<recovered_write_t> synced;   // In the order of their 'S' records
+    bool removed = false;               // An 'R' record came after the last write to it
+} recovered_file_t;
+
+typedef struct recovery_index {
+    deque<log_reader> logs;             // Kept mapped until the writes have been replayed
+    deque<string> decoded;              // Filenames and payloads of legacy records
+    unordered_map<int, recovered_write_t> undecided;   // 'W' records without an 'S' or 'A' yet
+    map<string, recovered_file_t, less<>> files;
+    size_t records = 0;
+    size_t bytes = 0;
+    size_t discarded = 0;
+} recovery_index_t;
+
+// What the last recovery (in gtfs_init) found and did
+typedef struct gtfs_recovery_stats {
+    size_t log_records;        // Records read from the log
+    size_t log_bytes;          // Bytes of log read
+    size_t writes_replayed;    // Synced writes laid down again
+    size_t writes_skipped;     // Synced writes already covered by their file's applied marker
+    size_t writes_discarded;   // Writes aborted, or never synced before the crash
+    size_t bytes_replayed;
+    size_t files_replayed;     // Data files written to
+    size_t files_removed;
+    unsigned threads;
+    double scan_ms;            // Phase one: reading and indexing the log
+    double replay_ms;          // Phase two: writing and syncing the data files
+} gtfs_recovery_stats_t;
+
+// One piece of the group commit buffer: either bytes staged in gtfs->log_buffer or a
+// payload still owned by a caller waiting for its record to become durable.
+typedef struct log_piece {
+    const char *ext;   // Caller-owned bytes, or NULL for log_buffer[off, off + len)
+    size_t off;
+    size_t len;
+} log_piece_t;
+
+// One record waiting in the background writer's queue
+struct log_queue_slot {
+    atomic<uint64_t> seq;     // Ring position this slot is ready for (Vyukov bounded queue)
+    string bytes;             // Header and filename, plus the payload when it had to be copied
+    const char *payload;      // Referenced payload, NULL when copied into bytes
+    size_t payload_len;
+    bool need_sync;
+    bool has_promise;
+    bool cut_after;           // End the writer's batch here and run on_durable on the writer before anything behind it is written
+    promise<gtfs_off_t> done;    // Fulfilled once the record is durable
+    function<gtfs_off_t(gtfs_lsn_t)> on_durable;   // Runs with the record's LSN once it is durable
+    file_t *apply_file;       // The one data file on_durable touches, NULL if it may touch several
+};
+
+// A durable record's on_durable, handed from the log writer to the completion path
+typedef struct log_completion {
+    function<gtfs_off_t(gtfs_lsn_t)> on_durable;
+    promise<gtfs_off_t> done;
+    bool has_promise;
+    gtfs_lsn_t lsn;
+    file_t *apply_file;
+} log_completion_t;
+
+// The completion path runs each durable batch's callbacks, which write synced data to the
+// data files, off the log writer. Batches complete in LSN order; within one, callbacks for
+// different files run in parallel on up to LOG_APPLY_THREADS threads.
+#define LOG_APPLY_THREADS 8
+
+// Bounded lock-free multi-producer queue drained by the single log writer thread
+struct log_queue {
+    unique_ptr<log_queue_slot[]> slots;
+    size_t mask = 0;
+    atomic<uint64_t> tail{0};   // Next position producers claim
+    uint64_t head = 0;          // Next position the writer consumes
+
+    explicit log_queue(size_t capacity);
+    // Claim a slot, waiting while the queue is full. pos receives its position.
+    log_queue_slot* claim(uint64_t &pos);
+    void publish(log_queue_slot *slot, uint64_t pos) { slot->seq.store(pos + 1, std::memory_order_release); }
+    // Slot at head + i if it has been published, NULL otherwise
+    log_queue_slot* peek(uint64_t i);
+    // Hand the first n slots back to producers
+    void release(uint64_t n);
+};
+
+// Memory in use and reserved by a gtfs_t's write pools
+typedef struct gtfs_pool_stats {
+    size_t write_slots;            // write_t slots carved from slabs
+    size_t writes_in_use;
+    size_t inline_writes;          // Writes whose payload sits inside the write_t
+    size_t payload_bytes_reserved; // Bytes carved from arena chunks
+    size_t payload_bytes_in_use;   // Bytes of arena blocks handed out
+    size_t heap_payload_bytes;     // Payloads too large for the arena, or caller-owned
+} gtfs_pool_stats_t;
+
+// Slab pool for write_t and size-classed arena for payloads. Memory is recycled when a
+// write is synced or aborted and only returned to the system when the gtfs_t goes away.
+struct write_pool {
+    mutex lock;
+    vector<char*> slabs;
+    vector<write_t*> free_writes;
+    vector<char*> chunks;
+    vector<char*> free_payloads[PAYLOAD_NUM_CLASSES];
+    gtfs_pool_stats_t stats = gtfs_pool_stats_t();
+
+    write_t* alloc_write();
+    void free_write(write_t *w);
+    char* alloc_payload(gtfs_off_t length, int &payload_class);
+    void free_payload(char *data, gtfs_off_t length, int payload_class);
+    ~write_pool();
+};
+
+// Block cache and read-ahead activity since gtfs_init (gtfs_get_cache_stats)
+typedef struct gtfs_cache_stats {
+    size_t hits;              // Blocks a read copied out of the cache
+    size_t misses;            // Blocks a read had to fetch from the data file
+    size_t evictions;
+    size_t blocks_cached;
+    size_t capacity_blocks;   // Budget in blocks, 0 while the cache is off
+    size_t readahead_calls;   // Prefetches issued for sequential streams
+    size_t readahead_bytes;
+} gtfs_cache_stats_t;
+
+typedef pair<file_t*, gtfs_off_t> cache_key_t;   // (file, block number)
+
+struct cache_key_hash {
+    size_t operator()(const cache_key_t &k) const {
+        return std::hash<file_t*>()(k.first) ^ ((size_t)k.second * 0x9E3779B97F4A7C15ull);
+    }
+};
+
+struct cache_block {
+    cache_key_t key;
+    bool hot;                              // In hot, otherwise in probation
+    list<cache_block*>::iterator pos;      // Place in its queue
+    char data[CACHE_BLOCK_BYTES];
+};
+
+// Data-file blocks kept in memory under a fixed budget, evicted by 2Q: a block read once
+// waits in a FIFO probation queue, and only one read again after it fell out of probation
+// (its key is still among the ghosts) joins the LRU hot queue. A long scan cycles through
+// probation without pushing hot blocks out. Guarded by lock; file_t::cache_epoch and
+// cache_blocks are too.
+struct block_cache {
+    mutex lock;
+    size_t capacity = 0;                   // Blocks, 0 while disabled
+    unordered_map<cache_key_t, cache_block*, cache_key_hash> blocks;
+    list<cache_block*> probation;          // Most recently inserted first
+    list<cache_block*> hot;                // Most recently used first
+    list<cache_key_t> ghosts;              // Keys recently evicted from probation, newest first
+    unordered_map<cache_key_t, list<cache_key_t>::iterator, cache_key_hash> ghost_index;
+    vector<cache_block*> free_blocks;
+    gtfs_cache_stats_t stats = gtfs_cache_stats_t();
+
+    // The cached block, moved to the front of hot if it is there, or NULL
+    cache_block* lookup(const cache_key_t &key);
+    // A block for key, which must not be cached, making room first if the cache is full.
+    // The caller fills its data.
+    cache_block* insert(const cache_key_t &key);
+    void drop(cache_block *b);
+    void evict_one();
+    void drop_file(file_t *fl);
+    void resize(size_t blocks);
+    ~block_cache();
+};
 
 struct gtfs {
     string dirname;
+    int dir_fd = -1;        // Data files are opened relative to this with openat
+    int applied_dir_fd = -1;    // APPLIED_DIR, holding the applied markers
     struct flock fl;
     char mode;//recover, Normal
+    shared_mutex files_lock;    // Guards open_files, closed_files, fd_lru and catalog
     unordered_map<string, file_t*> open_files;
     unordered_map<string,file_t*> closed_files;
-    fstream log_file;
+    list<file_t*> fd_lru;   // Closed files still holding a descriptor, most recently closed first
+    // Data files in the directory and their lengths, read once by gtfs_init and kept up to
+    // date by open and remove (guarded by files_lock). The log and markers are not listed.
+    unordered_map<string, off_t> catalog;
+    int log_fd = -1;        // Log opened with O_APPEND (and O_DSYNC under GTFS_SYNC_DSYNC)
+    gtfs_durability_t durability = GTFS_SYNC_FDATASYNC;
     string log_filename;
-    int next_write_id;
+    atomic<int> next_write_id;
+
+    // Group commit: records gather in log_buffer and become durable together
+    // with one write and one fsync issued by whichever caller leads the batch.
+    mutex log_mutex;
+    condition_variable log_durable_cv;   // Signals followers when a batch is durable
+    condition_variable log_window_cv;    // Wakes the leader early when the byte window fills
+    string log_buffer;            // Record headers and copied payloads
+    vector<log_piece_t> log_pieces;   // Everything buffered, in log order, for one writev
+    vector<size_t> log_record_offs;   // Where each staged record header sits in log_buffer (segmented log only)
+    size_t log_buffered_bytes = 0;
+    uint64_t log_appended = 0;    // Records appended to log_buffer so far
+    uint64_t log_durable = 0;     // Records written and synced
+    bool log_flushing = false;    // A leader is currently committing a batch
+    bool log_needs_sync = false;  // Some buffered record asked for a sync
+    bool log_failed = false;      // A log write failed, the log can no longer be trusted
+    int group_commit_window_us = 0;
+    size_t group_commit_max_bytes = 1 << 20;
+
+    // Optional background log writer (gtfs_start_log_writer). While it runs, records go
+    // through log_q instead of log_buffer and record lsn = log_lsn_base + queue position + 1.
+    unique_ptr<log_queue> log_q;
+    thread log_writer;
+    atomic<bool> log_writer_running{false};
+    atomic<bool> log_writer_stop{false};
+    atomic<bool> log_writer_idle{false};
+    mutex log_writer_mutex;
+    condition_variable log_writer_cv;
+    thread log_completer;
+    vector<thread> apply_workers;
+    mutex completion_mutex;
+    condition_variable completion_cv;        // Wakes the completer
+    condition_variable apply_cv;             // Wakes the apply workers
+    condition_variable completion_done_cv;   // A batch, or a batch's tasks, finished
+    deque<vector<log_completion_t>> completions;   // Durable batches not completed yet
+    deque<function<void()>> apply_tasks;
+    size_t apply_tasks_left = 0;
+    bool completion_busy = false;
+    bool completion_stop = false;
+    gtfs_lsn_t log_lsn_base = 0;
+    gtfs_lsn_t checkpoint_lsn = 0;    // Last checkpoint: nothing before it is left in the log
+
+    // Segmented log. log_fd is then the active segment, written at log_tail. Only the commit
+    // leader (or the log writer) moves between segments.
+    uint64_t segment_bytes = 0;       // 0 while the log is the single gtfs_log file
+    uint32_t first_segment = 0;       // Oldest live segment, as recorded in the manifest
+    uint32_t active_segment = 0;
+    off_t log_tail = 0;
+    deque<uint32_t> spare_segments;   // Retired segments waiting to be recycled, oldest first
+
+    write_pool pool;
+    block_cache cache;
+    io_engine *io = NULL;   // NULL for GTFS_IO_BLOCKING
+    gtfs_recovery_stats_t recovery_stats = gtfs_recovery_stats_t();
+
     // Additional fields for crash recovery
-    ~gtfs(){
-        for(auto f : open_files){
-            delete f.second;
-        }
-        for(auto f : closed_files){
-            delete f.second;
-        }       
-    }
+    ~gtfs();
 };
 
 struct write {
     gtfs_t *gtfs;
     file_t *file;
-    int offset;
-    int length;
+    gtfs_off_t offset;
+    gtfs_off_t length;
     char *data;
     int write_id;   // Unique write ID for this operation
+    int payload_class;   // Arena size class of data, WRITE_PAYLOAD_INLINE or WRITE_PAYLOAD_HEAP
+    char inline_data[WRITE_INLINE_BYTES];
+    write *next_range;   // Next range of the same gtfs_writev, synced and aborted along with this one
 
         // Constructor definition
-    write(gtfs_t* g, file_t* f, int o, int l, char* d, int id)
-        : gtfs(g), file(f), offset(o), length(l), data(d), write_id(id) {}
+    write(gtfs_t* g, file_t* f, gtfs_off_t o, gtfs_off_t l, char* d, int id)
+        : gtfs(g), file(f), offset(o), length(l), data(d), write_id(id), payload_class(WRITE_PAYLOAD_HEAP),
+          next_range(NULL) {}
+
+    // data is released by the gtfs_t's write_pool, see release_write
+};
+
+// Pending writes of one file, ordered by offset for overlap lookups and indexed by
+// write_id for sync and abort. Overlap queries cost O(log n + k); insert and erase O(log n).
+struct pending_index {
+    map<pair<gtfs_off_t, int>, write_t*> by_offset;   // (offset, write_id) -> write
+    unordered_map<int, write_t*> by_id;
+    multiset<gtfs_off_t> lengths;              // Bounds how far back an overlap can start
 
-    ~write() {
-    delete[] data;  // Ensure data is freed when write_t is destroyed
+    void insert(write_t *w);
+    bool erase(write_t *w);
+    write_t* find(int write_id) const;
+    // Writes overlapping [offset, offset + length), oldest first so newer writes win when applied in order
+    void overlapping(gtfs_off_t offset, gtfs_off_t length, vector<write_t*> &out) const;
+    // Copy the pending bytes overlapping [offset, offset + length) over buf, which holds that range.
+    // Does not allocate unless more than OVERLAY_INLINE writes overlap.
+    void overlay(gtfs_off_t offset, gtfs_off_t length, char *buf) const;
+    bool any_overlapping(gtfs_off_t offset, gtfs_off_t length) const;
+
+    // Call visit(w) for every write overlapping the range, in offset order
+    template <typename Visit>
+    void visit_overlapping(gtfs_off_t offset, gtfs_off_t length, Visit visit) const {
+        if (by_id.empty() || length <= 0) {
+            return;
+        }
+        // No pending write is longer than max_length, so nothing starting earlier can reach offset
+        gtfs_off_t first_start = offset - *lengths.rbegin() + 1;
+        gtfs_off_t end = offset + length;
+        map<pair<gtfs_off_t, int>, write_t*>::const_iterator it = by_offset.lower_bound(make_pair(first_start, INT_MIN));
+        for (; it != by_offset.end() && it->first.first < end; ++it) {
+            write_t *w = it->second;
+            if (w->offset + w->length > offset) {
+                visit(w);
+            }
+        }
     }
+    void clear();
+    bool empty() const { return by_id.empty(); }
+    size_t size() const { return by_id.size(); }
 };
 
 struct file {
     string filename;
-    int file_length;
-    vector<write_t*> pending_writes;
+    gtfs_off_t file_length;
+    pending_index pending_writes;
+    gtfs_durability_t durability;   // Never GTFS_SYNC_DEFAULT once opened
+    int fd;                         // Cached descriptor, -1 until first use
+    bool fd_dsync;                  // fd was opened with O_DSYNC
+    bool in_fd_lru;
+    list<file_t*>::iterator fd_lru_pos;
+    shared_mutex lock;              // Shared for reads, exclusive to change pending_writes or the mapping
+    mutex sync_mutex;               // Orders syncs of this file so data hits disk in log order
+    mutex fd_mutex;                 // Guards (re)opening fd
+    int open_flags;                 // GTFS_OPEN_* flags from gtfs_open_file
+    atomic<bool> data_dirty{false}; // Data written without a sync since the last checkpoint
+    atomic<gtfs_lsn_t> applied_lsn{0};  // LSN of the last write applied to the data file
+    int applied_fd;                 // Applied marker, -1 until first use (guarded by fd_mutex)
+    char *map;                      // Shared mapping of the data file in GTFS_OPEN_MMAP mode
+    size_t map_length;
+    uint64_t cache_epoch;           // Bumped by every write to the data file (guarded by gtfs->cache.lock)
+    size_t cache_blocks;            // Blocks of this file in gtfs->cache (guarded by gtfs->cache.lock)
+
+    // Access pattern seen by reads, guarded by readahead_mutex
+    mutex readahead_mutex;
+    gtfs_off_t ra_next;             // Where a sequential read would start
+    int ra_streak;                  // Reads in a row that were sequential (> 0) or not (< 0)
+    gtfs_off_t ra_window;           // Size of the last prefetch, 0 while no stream is detected
+    gtfs_off_t ra_mark;             // Start of the last prefetch: reading past it issues the next
+    gtfs_off_t ra_end;              // Prefetched up to here
+    int ra_advice;                  // POSIX_FADV_* last given for fd
 
     // Additional fields if necessary
 
     // Constructor to initialize filename and file_length
-    file(const string& fname, int flength)
-        : filename(fname), file_length(flength), pending_writes() {}  // pending_writes is default-initialized as an empty vector
+    file(const string& fname, gtfs_off_t flength, gtfs_durability_t dur = GTFS_SYNC_FDATASYNC)
+        : filename(fname), file_length(flength), pending_writes(), durability(dur),
+          fd(-1), fd_dsync(false), in_fd_lru(false), open_flags(0), applied_fd(-1), map(NULL), map_length(0),
+          cache_epoch(0), cache_blocks(0), ra_next(-1), ra_streak(0), ra_window(0), ra_mark(0), ra_end(0),
+          ra_advice(POSIX_FADV_NORMAL) {}  // pending_writes starts empty
+
+    ~file() {
+        if (map) {
+            munmap(map, map_length);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (applied_fd >= 0) {
+            close(applied_fd);
+        }
+    }
 
 };
 
+// Read-only view returned by gtfs_read_view. data points into the file's mapping unless a
+// pending write overlapped the range, in which case it points to a private copy (owned).
+typedef struct gtfs_view {
+    const char *data;
+    gtfs_off_t length;
+    char *owned;
+} gtfs_view_t;
+
+// One range of a gtfs_writev or gtfs_readv
+typedef struct gtfs_iovec {
+    gtfs_off_t offset;
+    gtfs_off_t length;
+    char *data;        // Bytes to write, or the buffer a read fills
+} gtfs_iovec_t;
+
 // GTFileSystem basic API calls
+//
+// Concurrency: a gtfs_t may be shared by many threads.
+// - open, close, remove and clean take gtfs->files_lock exclusively. No other call touches
+//   the file maps.
+// - Reads hold the file's lock shared. Adding or retiring a pending write holds it
+//   exclusively, but only for the index update.
+// - Syncs of the same file are serialized by file->sync_mutex, so data reaches the file in
+//   the same order as the 'S' records. Syncs of different files run in parallel.
+// - gtfs_checkpoint holds files_lock shared and swaps the log while no batch is being written
+//   and no durable sync is left unapplied.
+// - Write ids come from an atomic counter. Log appends only hold gtfs->log_mutex while
+//   staging a record (see group commit).
+// - Each write_t belongs to its caller: it must not be synced or aborted twice, or used after
+//   either call returns.
+//
+// Coalescing (GTFS_OPEN_COALESCE): writes of the file that are synced together (one
+// gtfs_sync_write_files batch, or the ranges of one gtfs_writev) are merged into one extent
+// per run of overlapping bytes, newest write winning, and adjacent extents share a pwritev,
+// so the sync writes each byte once. Pending writes are never merged with each other, so
+// aborting a write discards exactly its own bytes.
 
-gtfs_t* gtfs_init(string directory, int verbose_flag);
+gtfs_t* gtfs_init(string directory, int verbose_flag, gtfs_durability_t durability = GTFS_SYNC_FDATASYNC);
 int gtfs_clean(gtfs_t *gtfs);
+// Make every applied write durable in its data file and shrink the log to a checkpoint
+// record plus the W records of writes still pending. Costs O(pending writes) and runs
+// alongside other calls.
+int gtfs_checkpoint(gtfs_t *gtfs, gtfs_lsn_t *checkpoint_lsn = NULL);
+int gtfs_set_group_commit(gtfs_t *gtfs, int window_us, size_t max_bytes);
+// Move the log into preallocated segments of segment_bytes (see above). The switch goes
+// through a checkpoint. Later calls only change the size of segments created from then on,
+// and gtfs_init picks the segmented log up again from its manifest. Must not race with other
+// calls on the same gtfs_t.
+int gtfs_set_log_segments(gtfs_t *gtfs, size_t segment_bytes);
+// Returns the engine actually in use: GTFS_IO_URING falls back to GTFS_IO_THREADS where
+// io_uring is unavailable. Must not race with other calls on the same gtfs_t.
+int gtfs_set_io_engine(gtfs_t *gtfs, gtfs_io_engine_t engine, unsigned queue_depth = IO_DEFAULT_DEPTH);
+// Keep up to budget_bytes of data-file blocks in memory; 0 (the default) turns the cache off
+// and drops it. Reads of up to CACHE_MAX_READ_BLOCKS blocks are served from cached blocks,
+// with pending writes overlaid as usual, and syncs update cached blocks in place. Mapped files
+// bypass the cache. A file's blocks are dropped when it is opened, so changes made through
+// another gtfs_t show up from the next open on.
+int gtfs_set_block_cache(gtfs_t *gtfs, size_t budget_bytes);
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length);
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, gtfs_off_t file_length, gtfs_durability_t durability = GTFS_SYNC_DEFAULT, int open_flags = 0);
 int gtfs_close_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_remove_file(gtfs_t* gtfs, file_t* fl);
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length);
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data);
-int gtfs_sync_write_file(write_t* write_op);
+// Reads are watched for sequential streams, which are prefetched into the page cache ahead of
+// the reader (see READAHEAD_*); random access turns the kernel's own read-ahead off.
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, gtfs_off_t offset, gtfs_off_t length);
+gtfs_off_t gtfs_read_file_into(gtfs_t* gtfs, file_t* fl, gtfs_off_t offset, gtfs_off_t length, char* buf);
+gtfs_off_t gtfs_read_view(gtfs_t* gtfs, file_t* fl, gtfs_off_t offset, gtfs_off_t length, gtfs_view_t* view);
+void gtfs_release_view(gtfs_view_t* view);
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, gtfs_off_t offset, gtfs_off_t length, const char* data);
+write_t* gtfs_write_file_owned(gtfs_t* gtfs, file_t* fl, gtfs_off_t offset, gtfs_off_t length, unique_ptr<char[]> data);
+gtfs_off_t gtfs_sync_write_file(write_t* write_op);
+// Write n ranges of fl as one logical write: one log record now, and one handle whose sync
+// (one append of 'S' records, one data-file batch) or abort covers every range.
+write_t* gtfs_writev(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* ranges, int n);
+// Fill n ranges of fl, pending writes included. Adjacent ranges share a preadv, or all ranges
+// go to the I/O engine as one batch. Returns the total bytes read.
+gtfs_off_t gtfs_readv(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* ranges, int n);
+// Sync n writes with one log append and one durability point. Returns the total bytes
+// written, or -1 leaving the writes pending.
+gtfs_off_t gtfs_sync_write_files(gtfs_t* gtfs, write_t** write_ops, int n);
 int gtfs_abort_write_file(write_t* write_op);
-int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes);
-int gtfs_sync_write_file_n_bytes(write_t* write_op, int bytes);
+int gtfs_clean_n_bytes(gtfs_t *gtfs, gtfs_off_t bytes);
+int gtfs_sync_write_file_n_bytes(write_t* write_op, gtfs_off_t bytes);
+
+// Asynchronous log pipeline. gtfs_start_log_writer moves log I/O to a background thread.
+// The *_async calls return as soon as their record is queued. The future becomes ready
+// once the record is durable (and, for sync and abort, once the write has been applied).
+// Without a running writer they complete inline and return a ready future.
+// Start and stop must not race with other calls on the same gtfs_t.
+int gtfs_start_log_writer(gtfs_t *gtfs, size_t queue_capacity);
+int gtfs_stop_log_writer(gtfs_t *gtfs);
+int gtfs_wait_durable(gtfs_t *gtfs, gtfs_lsn_t lsn);
+future<gtfs_off_t> gtfs_write_file_async(gtfs_t* gtfs, file_t* fl, gtfs_off_t offset, gtfs_off_t length, const char* data, write_t** write_op, gtfs_lsn_t *lsn = NULL);
+future<gtfs_off_t> gtfs_sync_write_file_async(write_t* write_op, gtfs_lsn_t *lsn = NULL);
+future<gtfs_off_t> gtfs_abort_write_file_async(write_t* write_op, gtfs_lsn_t *lsn = NULL);
+int gtfs_get_pool_stats(gtfs_t *gtfs, gtfs_pool_stats_t *stats);
+int gtfs_get_cache_stats(gtfs_t *gtfs, gtfs_cache_stats_t *stats);
+int gtfs_get_recovery_stats(gtfs_t *gtfs, gtfs_recovery_stats_t *stats);
 
 // Additional helper functions
 int recover_from_log(gtfs_t *gtfs);
-int write_log_entry(gtfs_t *gtfs, log_entry_t &entry);
+int write_log_entry(gtfs_t *gtfs, log_entry_t &entry, gtfs_durability_t durability = GTFS_SYNC_DEFAULT, gtfs_lsn_t *lsn = NULL);
+string generate_log_entry(const log_entry_t &entry);
+string generate_log_header(const log_entry_t &entry, const char *payload, size_t payload_len);
+// segment is the number of the segment being read, or 0 for the single-file log
+int read_log_entry(istream &in, log_entry_t &entry, uint32_t segment = 0);
+uint32_t log_crc32(uint32_t crc, const char *buf, size_t len);
 void flush_log_file(gtfs_t *gtfs);
 
 #endif
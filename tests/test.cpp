@@ -4,6 +4,8 @@
 string directory;
 int verbose;
 #include <filesystem> 
+#include <thread>
+#include <atomic>
 // **Test 1**: Testing that data written by one process is then successfully read by another process.
 void writer() {
     gtfs_t *gtfs = gtfs_init(directory, verbose);
@@ -127,6 +129,8 @@ void test_truncate_log_n_bytes() {
     write_t *wrt1 = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
     gtfs_sync_write_file(wrt1);
 
+    // A negative count is refused rather than padding the log
+    bool rejected = gtfs_clean_n_bytes(gtfs, -8) == -1;
     gtfs_clean_n_bytes(gtfs, truncate_byte);
     gtfs_close_file(gtfs, fl); 
 
@@ -166,7 +170,7 @@ void test_truncate_log_n_bytes() {
     logfile.close();
 
     //----------------compare size---------------------
-    if(logcontent_noclean.size() - logcontent.size()== truncate_byte*8){
+    if(rejected && logcontent_noclean.size() - logcontent.size()== truncate_byte){
         cout << PASS;
     }
     else{
@@ -197,6 +201,7 @@ void test_write_n_byteds() {
 
 
     write_t *wrt2 = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+    bool rejected = gtfs_sync_write_file_n_bytes(wrt2, -1) == -1;
     gtfs_sync_write_file_n_bytes(wrt2, n_bytes);
     std::string data2; // String to hold the file content
     // Read the entire file content
@@ -212,7 +217,7 @@ void test_write_n_byteds() {
             return;
         }
     }
-    if(data2.size()== n_bytes){
+    if(rejected && data2.size()== n_bytes){
         cout<<PASS;
     }
     else{
@@ -451,6 +456,1175 @@ void test_open_file_size() {
 }
 
 
+// Test 12
+void test_durability_policies() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_durability_t policies[] = {GTFS_SYNC_NONE, GTFS_SYNC_FLUSH, GTFS_SYNC_FDATASYNC, GTFS_SYNC_DSYNC};
+    string str = "Testing string.\n";
+    bool ok = true;
+
+    for (int i = 0; i < 4; i++) {
+        string filename = "test12_" + to_string(i) + ".txt";
+        file_t *fl = gtfs_open_file(gtfs, filename, 100, policies[i]);
+        if (fl == NULL) {
+            ok = false;
+            break;
+        }
+        write_t *wrt = gtfs_write_file(gtfs, fl, 10, str.length(), str.c_str());
+        gtfs_sync_write_file(wrt);
+        gtfs_close_file(gtfs, fl);
+
+        // The data file itself must hold the synced bytes under every policy
+        std::ifstream infile(filename);
+        std::string content((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+        if (content.size() != 100 || content.compare(10, str.length(), str) != 0) {
+            cout << "policy " << policies[i] << " lost data\n";
+            ok = false;
+        }
+    }
+    ok ? cout << PASS : cout << FAIL;
+}
+// Test 13
+void test_overlapping_pending_writes() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test13.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+
+    // Older, wider write first; newer writes on top must win where they overlap
+    write_t *wrt1 = gtfs_write_file(gtfs, fl, 0, 10, "aaaaaaaaaa");
+    write_t *wrt2 = gtfs_write_file(gtfs, fl, 2, 4, "bbbb");
+    write_t *wrt3 = gtfs_write_file(gtfs, fl, 4, 4, "cccc");
+    write_t *wrt4 = gtfs_write_file(gtfs, fl, 50, 4, "dddd");
+
+    char *data = gtfs_read_file(gtfs, fl, 0, 10);
+    bool ok = data != NULL && string(data) == "aabbccccaa";
+
+    gtfs_abort_write_file(wrt3);
+    data = gtfs_read_file(gtfs, fl, 0, 10);
+    ok = ok && data != NULL && string(data) == "aabbbbaaaa";
+
+    gtfs_sync_write_file(wrt1);
+    gtfs_sync_write_file(wrt2);
+    gtfs_sync_write_file(wrt4);
+    data = gtfs_read_file(gtfs, fl, 0, 10);
+    ok = ok && data != NULL && string(data) == "aabbbbaaaa";
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+// Test 14
+void test_read_into_buffer() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test14.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+
+    string str = "Testing string.\n";
+    write_t *wrt1 = gtfs_write_file(gtfs, fl, 30, str.length(), str.c_str());
+    gtfs_sync_write_file(wrt1);
+    write_t *wrt2 = gtfs_write_file(gtfs, fl, 34, 3, "XYZ");
+
+    // Range straddles synced data and a pending write
+    char buf[8];
+    int n = gtfs_read_file_into(gtfs, fl, 32, sizeof(buf), buf);
+    bool ok = n == (int)sizeof(buf) && string(buf, sizeof(buf)) == "stXYZ st";
+    // Reading past the end of the file is rejected
+    ok = ok && gtfs_read_file_into(gtfs, fl, 96, sizeof(buf), buf) < 0;
+    ok ? cout << PASS : cout << FAIL;
+
+    gtfs_abort_write_file(wrt2);
+    gtfs_close_file(gtfs, fl);
+}
+// Test 15
+void test_mmap_read_view() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test15.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100, GTFS_SYNC_DEFAULT, GTFS_OPEN_MMAP);
+
+    string str = "Testing string.\n";
+    write_t *wrt1 = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+    gtfs_sync_write_file(wrt1);
+
+    // No pending write overlaps: the view points straight into the mapping
+    gtfs_view_t view;
+    bool ok = gtfs_read_view(gtfs, fl, 0, str.length(), &view) == (int)str.length()
+        && view.owned == NULL && string(view.data, view.length) == str;
+    gtfs_release_view(&view);
+
+    // A pending write overlaps: the view is a private copy with the write applied
+    write_t *wrt2 = gtfs_write_file(gtfs, fl, 8, 3, "XYZ");
+    ok = ok && gtfs_read_view(gtfs, fl, 0, str.length(), &view) == (int)str.length()
+        && view.owned != NULL && string(view.data, view.length) == "Testing XYZing.\n";
+    gtfs_release_view(&view);
+    gtfs_abort_write_file(wrt2);
+    gtfs_close_file(gtfs, fl);
+
+    // The synced bytes reached the file through the mapping
+    std::ifstream infile(filename);
+    std::string content((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+    ok = ok && content.compare(0, str.length(), str) == 0;
+    ok ? cout << PASS : cout << FAIL;
+}
+// Test 16
+void test_write_owned_buffer() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test16.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+
+    string str = "Testing string.\n";
+    unique_ptr<char[]> buf(new char[str.length()]);
+    memcpy(buf.get(), str.c_str(), str.length());
+    const char *raw = buf.get();
+
+    // The library keeps the caller's buffer as the pending write's data
+    write_t *wrt = gtfs_write_file_owned(gtfs, fl, 40, str.length(), std::move(buf));
+    bool ok = wrt != NULL && wrt->data == raw && buf == nullptr;
+    char *data = gtfs_read_file(gtfs, fl, 40, str.length());
+    ok = ok && data != NULL && str.compare(data) == 0;
+    gtfs_sync_write_file(wrt);
+    gtfs_close_file(gtfs, fl);
+
+    // The write was logged, so a recovering instance sees the same bytes
+    gtfs = gtfs_init(directory, verbose);
+    fl = gtfs_open_file(gtfs, filename, 100);
+    data = gtfs_read_file(gtfs, fl, 40, str.length());
+    ok = ok && data != NULL && str.compare(data) == 0;
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+// Test 17
+void test_write_pool_recycling() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_NONE);
+    string filename = "test17.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 4096);
+
+    string small_str = "small";
+    string large_str(1000, 'L');
+    gtfs_pool_stats_t stats;
+    size_t reserved_after_first_round = 0;
+    bool ok = true;
+
+    for (int round = 0; round < 3; round++) {
+        write_t *writes[20];
+        for (int i = 0; i < 20; i++) {
+            string &str = i % 2 ? large_str : small_str;
+            writes[i] = gtfs_write_file(gtfs, fl, i * 100, str.length(), str.c_str());
+        }
+        gtfs_get_pool_stats(gtfs, &stats);
+        ok = ok && stats.writes_in_use == 20 && stats.inline_writes == 10 && stats.payload_bytes_in_use > 0;
+        for (int i = 0; i < 20; i++) {
+            i % 3 ? gtfs_sync_write_file(writes[i]) : gtfs_abort_write_file(writes[i]);
+        }
+
+        // Synced and aborted writes go back to the pools, which do not grow across rounds
+        gtfs_get_pool_stats(gtfs, &stats);
+        ok = ok && stats.writes_in_use == 0 && stats.inline_writes == 0 && stats.payload_bytes_in_use == 0;
+        if (round == 0) {
+            reserved_after_first_round = stats.payload_bytes_reserved;
+        }
+        ok = ok && stats.payload_bytes_reserved == reserved_after_first_round;
+    }
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+// Test 18
+// Writers on private files and on disjoint slots of one shared file, all through one gtfs_t
+void test_concurrent_stress() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    const int num_threads = 8;
+    const int ops_per_thread = 300;
+    const int slot = 16;
+    file_t *shared_fl = gtfs_open_file(gtfs, "test18_shared.txt", num_threads * slot);
+    std::atomic<int> errors(0);
+
+    vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            string filename = "test18_" + to_string(t) + ".txt";
+            file_t *fl = gtfs_open_file(gtfs, filename, 50 * slot);
+            if (fl == NULL) {
+                errors++;
+                return;
+            }
+            for (int i = 0; i < ops_per_thread; i++) {
+                char str[slot + 1];
+                snprintf(str, sizeof(str), "t%02d-op%05d....", t, i);
+                int offset = (i % 50) * slot;
+
+                write_t *wrt = gtfs_write_file(gtfs, fl, offset, slot, str);
+                char *data = gtfs_read_file(gtfs, fl, offset, slot);
+                if (wrt == NULL || data == NULL || string(data) != str) errors++;
+                delete[] data;
+                i % 4 == 3 ? gtfs_abort_write_file(wrt) : gtfs_sync_write_file(wrt);
+
+                write_t *shared_wrt = gtfs_write_file(gtfs, shared_fl, t * slot, slot, str);
+                if (shared_wrt == NULL || gtfs_sync_write_file(shared_wrt) != slot) errors++;
+                data = gtfs_read_file(gtfs, shared_fl, t * slot, slot);
+                if (data == NULL || string(data) != str) errors++;
+                delete[] data;
+            }
+            gtfs_close_file(gtfs, fl);
+        });
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+
+    // Every slot of the shared file holds its thread's last write
+    for (int t = 0; t < num_threads; t++) {
+        char expected[slot + 1];
+        snprintf(expected, sizeof(expected), "t%02d-op%05d....", t, ops_per_thread - 1);
+        char *data = gtfs_read_file(gtfs, shared_fl, t * slot, slot);
+        if (data == NULL || string(data) != expected) errors++;
+        delete[] data;
+    }
+    gtfs_close_file(gtfs, shared_fl);
+    errors == 0 ? cout << PASS : cout << FAIL << errors << " errors\n";
+}
+
+// Test 19
+// Writes, syncs and aborts through the background log writer, completed by futures
+void test_async_log_writer() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test19.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+    bool ok = gtfs_start_log_writer(gtfs, 16) == 0;
+
+    const int num_writes = 40;
+    write_t *writes[num_writes];
+    vector<future<gtfs_off_t>> done;
+    vector<string> strs;
+    gtfs_lsn_t lsn = 0, last_lsn = 0;
+    for (int i = 0; i < num_writes; i++) {
+        strs.push_back("async" + to_string(100 + i) + "|");
+        done.push_back(gtfs_write_file_async(gtfs, fl, i * 10, 9, strs[i].c_str(), &writes[i], &lsn));
+        ok = ok && writes[i] != NULL && lsn > last_lsn;
+        last_lsn = lsn;
+    }
+    for (auto &f : done) {
+        ok = ok && f.get() == 0;
+    }
+
+    // Pending writes are visible before they are synced
+    char *data = gtfs_read_file(gtfs, fl, 10, 9);
+    ok = ok && data != NULL && strs[1].compare(data) == 0;
+    delete[] data;
+
+    done.clear();
+    for (int i = 0; i < num_writes; i++) {
+        done.push_back(i % 5 ? gtfs_sync_write_file_async(writes[i], &lsn) : gtfs_abort_write_file_async(writes[i], &lsn));
+    }
+    ok = ok && gtfs_wait_durable(gtfs, lsn) == 0;
+    for (int i = 0; i < num_writes; i++) {
+        ok = ok && done[i].get() == (i % 5 ? 9 : 0);
+    }
+
+    // Syncs to different files complete in parallel, each file's in log order
+    file_t *fl2 = gtfs_open_file(gtfs, "test19b.txt", 100);
+    done.clear();
+    for (int v = 0; v < 20; v++) {
+        string version = "version" + to_string(10 + v);
+        write_t *w1 = gtfs_write_file(gtfs, fl, 600, 9, version.c_str());
+        write_t *w2 = gtfs_write_file(gtfs, fl2, 0, 9, version.c_str());
+        done.push_back(gtfs_sync_write_file_async(w1));
+        done.push_back(gtfs_sync_write_file_async(w2));
+    }
+    for (auto &f : done) {
+        ok = ok && f.get() == 9;
+    }
+
+    // The blocking calls keep working through the writer
+    write_t *wrt = gtfs_write_file(gtfs, fl, 500, 9, "blocking|");
+    ok = ok && wrt != NULL && gtfs_sync_write_file(wrt) == 9;
+    ok = ok && gtfs_stop_log_writer(gtfs) == 0;
+
+    for (int i = 0; i < num_writes; i++) {
+        data = gtfs_read_file(gtfs, fl, i * 10, 9);
+        ok = ok && data != NULL && (i % 5 ? strs[i].compare(data) == 0 : data[0] == 0);
+        delete[] data;
+    }
+    data = gtfs_read_file(gtfs, fl, 500, 9);
+    ok = ok && data != NULL && string(data) == "blocking|";
+    delete[] data;
+    data = gtfs_read_file(gtfs, fl, 600, 9);
+    ok = ok && data != NULL && string(data) == "version29";
+    delete[] data;
+    data = gtfs_read_file(gtfs, fl2, 0, 9);
+    ok = ok && data != NULL && string(data) == "version29";
+    delete[] data;
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+    gtfs_close_file(gtfs, fl2);
+}
+
+// Test 20
+// The same write / sync / read workload on every I/O engine, from several threads
+void test_io_engines() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_io_engine_t engines[] = {GTFS_IO_URING, GTFS_IO_THREADS, GTFS_IO_BLOCKING};
+    const int num_threads = 4;
+    bool ok = true;
+
+    for (gtfs_io_engine_t engine : engines) {
+        int in_use = gtfs_set_io_engine(gtfs, engine, 8);
+        ok = ok && (in_use == engine || (engine == GTFS_IO_URING && in_use == GTFS_IO_THREADS));
+
+        std::atomic<int> errors(0);
+        vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                string filename = "test20_" + to_string(t) + ".txt";
+                file_t *fl = gtfs_open_file(gtfs, filename, 4096);
+                for (int i = 0; i < 20 && fl; i++) {
+                    string str = "engine" + to_string(engine) + "-op" + to_string(i) + "|";
+                    write_t *wrt = gtfs_write_file(gtfs, fl, i * 32, str.length(), str.c_str());
+                    if (wrt == NULL || gtfs_sync_write_file(wrt) != (int)str.length()) errors++;
+                    char *data = gtfs_read_file(gtfs, fl, i * 32, str.length());
+                    if (data == NULL || str.compare(data) != 0) errors++;
+                    delete[] data;
+                }
+                if (fl == NULL || gtfs_close_file(gtfs, fl) != 0) errors++;
+            });
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+        ok = ok && errors == 0;
+    }
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// Test 21
+// Batched syncs: contiguous and overlapping writes across several files, with and without
+// the log writer
+void test_sync_write_batch() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_set_io_engine(gtfs, GTFS_IO_THREADS, 4);
+    const int num_files = 3;
+    file_t *files[num_files];
+    for (int f = 0; f < num_files; f++) {
+        files[f] = gtfs_open_file(gtfs, "test21_" + to_string(f) + ".txt", 1000);
+    }
+    bool ok = true;
+
+    for (int round = 0; round < 2; round++) {
+        if (round == 1) {
+            gtfs_start_log_writer(gtfs, 64);
+        }
+        vector<write_t*> batch;
+        int expected = 0;
+        for (int f = 0; f < num_files; f++) {
+            // Ten back-to-back writes, submitted out of order
+            for (int i = 9; i >= 0; i--) {
+                string str = "r" + to_string(round) + "f" + to_string(f) + "w" + to_string(i);
+                str.resize(8, '.');
+                batch.push_back(gtfs_write_file(gtfs, files[f], i * 8, 8, str.c_str()));
+                expected += 8;
+            }
+        }
+        // Overlapping writes to one file: the later write must win
+        batch.push_back(gtfs_write_file(gtfs, files[0], 200, 6, "first!"));
+        batch.push_back(gtfs_write_file(gtfs, files[0], 203, 6, "second"));
+        expected += 12;
+
+        ok = ok && gtfs_sync_write_files(gtfs, batch.data(), batch.size()) == expected;
+        for (int f = 0; f < num_files; f++) {
+            char *data = gtfs_read_file(gtfs, files[f], 72, 8);
+            string str = "r" + to_string(round) + "f" + to_string(f) + "w9";
+            str.resize(8, '.');
+            ok = ok && data != NULL && str.compare(data) == 0;
+            delete[] data;
+        }
+        char *data = gtfs_read_file(gtfs, files[0], 200, 9);
+        ok = ok && data != NULL && string(data) == "firsecond";
+        delete[] data;
+
+        gtfs_pool_stats_t stats;
+        gtfs_get_pool_stats(gtfs, &stats);
+        ok = ok && stats.writes_in_use == 0;
+    }
+    gtfs_stop_log_writer(gtfs);
+
+    // A batch naming the same write twice is refused
+    write_t *wrt = gtfs_write_file(gtfs, files[1], 500, 4, "dup!");
+    write_t *dup[2] = {wrt, wrt};
+    ok = ok && gtfs_sync_write_files(gtfs, dup, 2) == -1 && gtfs_sync_write_file(wrt) == 4;
+
+    // Overlapping writes batched newest first: recovery must lay down the same bytes as the
+    // live file, which it only replays on files without applied markers. Coalescing merges
+    // them into one extent, newest bytes on top.
+    const int open_flags[2] = {0, GTFS_OPEN_COALESCE};
+    file_t *reversed[2];
+    for (int k = 0; k < 2; k++) {
+        reversed[k] = gtfs_open_file(gtfs, "test21_reversed" + to_string(k) + ".txt", 100, GTFS_SYNC_FLUSH, open_flags[k]);
+        write_t *older = gtfs_write_file(gtfs, reversed[k], 0, 4, "AAAA");
+        write_t *newer = gtfs_write_file(gtfs, reversed[k], 2, 4, "BBBB");
+        write_t *newest_first[2] = {newer, older};
+        ok = ok && gtfs_sync_write_files(gtfs, newest_first, 2) == 8;
+        char *data = gtfs_read_file(gtfs, reversed[k], 0, 6);
+        ok = ok && data != NULL && string(data) == "AABBBB";
+        delete[] data;
+    }
+    flush_log_file(gtfs);
+
+    gtfs_t *recovered = gtfs_init(directory, verbose);
+    for (int k = 0; k < 2; k++) {
+        file_t *rfl = gtfs_open_file(recovered, "test21_reversed" + to_string(k) + ".txt", 100);
+        char *data = gtfs_read_file(recovered, rfl, 0, 6);
+        ok = ok && data != NULL && string(data) == "AABBBB";
+        delete[] data;
+        gtfs_close_file(recovered, rfl);
+    }
+
+    ok ? cout << PASS : cout << FAIL;
+    for (int f = 0; f < num_files; f++) {
+        gtfs_close_file(gtfs, files[f]);
+    }
+    gtfs_close_file(gtfs, reversed[0]);
+    gtfs_close_file(gtfs, reversed[1]);
+}
+
+// Test 22
+// Aborting a write discards only its own bytes; writes synced together merge where they overlap
+void test_coalesce_pending_writes() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    string filename = "test22.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 1000, GTFS_SYNC_DEFAULT, GTFS_OPEN_COALESCE);
+    gtfs_pool_stats_t stats;
+    bool ok = true;
+
+    // A hundred versions of one region stay separate writes until they are synced
+    write_t *versions[100];
+    for (int i = 0; i < 100; i++) {
+        char str[17];
+        snprintf(str, sizeof(str), "version%09d", i);
+        versions[i] = gtfs_write_file(gtfs, fl, 0, 16, str);
+    }
+    gtfs_get_pool_stats(gtfs, &stats);
+    ok = ok && stats.writes_in_use == 100;
+    char *data = gtfs_read_file(gtfs, fl, 0, 16);
+    ok = ok && data != NULL && string(data) == "version000000099";
+    delete[] data;
+
+    // Aborting the newest version brings the one before it back
+    ok = ok && gtfs_abort_write_file(versions[99]) == 0;
+    data = gtfs_read_file(gtfs, fl, 0, 16);
+    ok = ok && data != NULL && string(data) == "version000000098";
+    delete[] data;
+
+    // Synced together, the rest land as one extent holding the newest of them
+    ok = ok && gtfs_sync_write_files(gtfs, versions, 99) == 99 * 16;
+
+    // Aborting one of two adjacent writes leaves the other alone
+    write_t *left = gtfs_write_file(gtfs, fl, 100, 4, "left");
+    write_t *right = gtfs_write_file(gtfs, fl, 104, 5, "right");
+    ok = ok && left->offset == 100 && left->length == 4 && right->offset == 104 && right->length == 5;
+    ok = ok && gtfs_abort_write_file(left) == 0;
+    data = gtfs_read_file(gtfs, fl, 100, 9);
+    ok = ok && data != NULL && data[0] == 0 && string(data + 4, 5) == "right";
+    delete[] data;
+    ok = ok && gtfs_sync_write_file(right) == 5;
+
+    // Overlapping writes in one batch: newest wins
+    write_t *batch[3];
+    batch[0] = gtfs_write_file(gtfs, fl, 200, 3, "abc");
+    batch[1] = gtfs_write_file(gtfs, fl, 202, 3, "CDE");
+    batch[2] = gtfs_write_file(gtfs, fl, 300, 3, "xyz");
+    ok = ok && gtfs_sync_write_files(gtfs, batch, 3) == 9;
+
+    gtfs_close_file(gtfs, fl);
+    fl = gtfs_open_file(gtfs, filename, 1000);
+    data = gtfs_read_file(gtfs, fl, 200, 5);
+    ok = ok && data != NULL && string(data) == "abCDE";
+    delete[] data;
+    data = gtfs_read_file(gtfs, fl, 0, 16);
+    ok = ok && data != NULL && string(data) == "version000000098";
+    delete[] data;
+    data = gtfs_read_file(gtfs, fl, 100, 9);
+    ok = ok && data != NULL && data[0] == 0 && string(data + 4, 5) == "right";
+    delete[] data;
+
+    gtfs_get_pool_stats(gtfs, &stats);
+    ok = ok && stats.writes_in_use == 0 && stats.payload_bytes_in_use == 0;
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// Test 23
+// A checkpoint shrinks the log to the writes still pending, and recovery replays what
+// follows it. Runs with group commit and then with the log writer.
+void test_checkpoint() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_clean(gtfs);
+    string filename = "test23.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+    string log_path = directory + "/gtfs_log";
+    bool ok = true;
+
+    for (int round = 0; round < 2; round++) {
+        if (round == 1) {
+            gtfs_start_log_writer(gtfs, 64);
+        }
+        for (int i = 0; i < 200; i++) {
+            string str = "r" + to_string(round) + "w" + to_string(i);
+            str.resize(8, '.');
+            write_t *wrt = gtfs_write_file(gtfs, fl, (i % 50) * 8, 8, str.c_str());
+            ok = ok && gtfs_sync_write_file(wrt) == 8;
+        }
+        write_t *pending = gtfs_write_file(gtfs, fl, 500, 7, round == 0 ? "carried" : "CARRIED");
+        flush_log_file(gtfs);
+
+        uintmax_t before = std::filesystem::file_size(log_path);
+        gtfs_lsn_t lsn = 0;
+        ok = ok && gtfs_checkpoint(gtfs, &lsn) == 0 && lsn > 0;
+        uintmax_t after = std::filesystem::file_size(log_path);
+        cout << "Log shrank from " << before << " to " << after << " bytes\n";
+        ok = ok && after < before / 10;
+
+        // The carried write is synced after the checkpoint. Spoil its bytes in the data file:
+        // recovery has to lay them down again from the new log.
+        ok = ok && gtfs_sync_write_file(pending) == 7;
+        flush_log_file(gtfs);
+        fstream data_file(directory + "/" + filename, ios::in | ios::out | ios::binary);
+        data_file.seekp(500);
+        data_file.write("garbage", 7);
+        data_file.close();
+
+        gtfs_t *recovered = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+        file_t *rfl = gtfs_open_file(recovered, filename, 1000);
+        char *data = gtfs_read_file(recovered, rfl, 500, 7);
+        ok = ok && data != NULL && string(data) == (round == 0 ? "carried" : "CARRIED");
+        delete[] data;
+        data = gtfs_read_file(recovered, rfl, 49 * 8, 8);
+        string last = "r" + to_string(round) + "w199";
+        last.resize(8, '.');
+        ok = ok && data != NULL && string(data) == last;
+        delete[] data;
+        gtfs_close_file(recovered, rfl);
+    }
+    gtfs_stop_log_writer(gtfs);
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// Test 24
+// Segmented log: switching over carries pending writes, checkpoints recycle old segments,
+// and records left in a recycled segment from its previous life are never replayed
+int count_log_segments(const string &dir) {
+    int count = 0;
+    for (auto &ent : std::filesystem::directory_iterator(dir)) {
+        string name = ent.path().filename().string();
+        if (name.rfind("gtfs_log.0", 0) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void test_log_segments() {
+
+    string dir = directory + "/test24";
+    std::filesystem::remove_all(dir);
+    const size_t segment_bytes = 64 * 1024;
+    // Data syncs wait for the checkpoint, so only it moves the file's applied marker
+    gtfs_t *gtfs = gtfs_init(dir, verbose, GTFS_SYNC_FLUSH);
+    string filename = "test24.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 4000);
+    bool ok = true;
+
+    write_t *pending = gtfs_write_file(gtfs, fl, 3500, 6, "before");
+    ok = ok && gtfs_set_log_segments(gtfs, segment_bytes) == 0;
+    ok = ok && std::filesystem::exists(dir + "/gtfs_log.manifest");
+    ok = ok && std::filesystem::file_size(dir + "/gtfs_log") == 0;
+    ok = ok && std::filesystem::file_size(dir + "/gtfs_log.000001") == segment_bytes;
+    ok = ok && gtfs_sync_write_file(pending) == 6;
+
+    string block(900, '.');
+    for (int i = 0; i < 300; i++) {
+        string str = "old" + to_string(i) + block;
+        write_t *wrt = gtfs_write_file(gtfs, fl, (i % 3) * 1000, 900, str.c_str());
+        ok = ok && gtfs_sync_write_file(wrt) == 900;
+    }
+    int segments = count_log_segments(dir);
+    cout << "Segments after 300 writes: " << segments << "\n";
+    ok = ok && segments > 3;
+
+    ok = ok && gtfs_checkpoint(gtfs) == 0;
+    ok = ok && count_log_segments(dir) <= 1 + LOG_SEGMENTS_KEPT;
+
+    // Fewer records this time, so the last segment still holds old records past its tail
+    for (int i = 0; i < 100; i++) {
+        string str = "new" + to_string(i) + block;
+        write_t *wrt = gtfs_write_file(gtfs, fl, (i % 3) * 1000, 900, str.c_str());
+        ok = ok && gtfs_sync_write_file(wrt) == 900;
+    }
+    segments = count_log_segments(dir);
+    cout << "Segments after checkpoint and 100 writes: " << segments << "\n";
+    ok = ok && segments <= 3 + LOG_SEGMENTS_KEPT;
+
+    // Spoil the data file: recovery has to rebuild it from the live segments alone
+    fstream data_file(dir + "/" + filename, ios::in | ios::out | ios::binary);
+    data_file.write(string(4000, 'x').data(), 4000);
+    data_file.close();
+
+    gtfs_t *recovered = gtfs_init(dir, verbose, GTFS_SYNC_FLUSH);
+    file_t *rfl = gtfs_open_file(recovered, filename, 4000);
+    for (int i = 97; i < 100; i++) {
+        char *data = gtfs_read_file(recovered, rfl, (i % 3) * 1000, 6);
+        ok = ok && data != NULL && string(data, 5) == "new" + to_string(i);
+        delete[] data;
+    }
+    // Its records went with the checkpoint, so recovery leaves the data file alone there
+    char *data = gtfs_read_file(recovered, rfl, 3500, 6);
+    ok = ok && data != NULL && string(data) == "xxxxxx";
+    delete[] data;
+    gtfs_close_file(recovered, rfl);
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// Test 25
+// Recovery replays synced writes across files in parallel, drops aborted and unsynced ones,
+// and reports what it did
+void test_parallel_recovery() {
+
+    // No checkpoint runs, so no applied marker lets recovery skip a write
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_clean(gtfs);
+    const int num_files = 4;
+    file_t *files[num_files];
+    for (int f = 0; f < num_files; f++) {
+        files[f] = gtfs_open_file(gtfs, "test25_" + to_string(f) + ".txt", 1000);
+        for (int j = 0; j < 50; j++) {
+            string str = "f" + to_string(f) + "w" + to_string(j);
+            str.resize(16, '.');
+            gtfs_sync_write_file(gtfs_write_file(gtfs, files[f], (j % 5) * 100, 16, str.c_str()));
+        }
+        gtfs_abort_write_file(gtfs_write_file(gtfs, files[f], 600, 7, "aborted"));
+        gtfs_write_file(gtfs, files[f], 700, 7, "pending");
+    }
+    file_t *gone = gtfs_open_file(gtfs, "test25_gone.txt", 100);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, gone, 0, 4, "gone"));
+    gtfs_close_file(gtfs, gone);
+    gtfs_remove_file(gtfs, gone);
+    flush_log_file(gtfs);
+
+    // Spoil what the synced writes put in the data files
+    for (int f = 0; f < num_files; f++) {
+        fstream data_file(directory + "/test25_" + to_string(f) + ".txt", ios::in | ios::out | ios::binary);
+        data_file.write(string(500, 'x').data(), 500);
+        data_file.close();
+    }
+
+    gtfs_t *recovered = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_recovery_stats_t stats;
+    bool ok = gtfs_get_recovery_stats(recovered, &stats) == 0;
+    cout << "Recovered " << stats.log_records << " records, replayed " << stats.writes_replayed << " writes to "
+         << stats.files_replayed << " files on " << stats.threads << " threads\n";
+    ok = ok && stats.writes_replayed == num_files * 50 && stats.files_replayed == num_files;
+    ok = ok && stats.files_removed == 1 && stats.writes_discarded == 2 * num_files + 1;
+    ok = ok && stats.threads >= 1 && stats.bytes_replayed == (size_t)num_files * 50 * 16;
+
+    for (int f = 0; f < num_files; f++) {
+        file_t *fl = gtfs_open_file(recovered, "test25_" + to_string(f) + ".txt", 1000);
+        for (int j = 45; j < 50; j++) {
+            string str = "f" + to_string(f) + "w" + to_string(j);
+            str.resize(16, '.');
+            char *data = gtfs_read_file(recovered, fl, (j % 5) * 100, 16);
+            ok = ok && data != NULL && string(data) == str;
+            delete[] data;
+        }
+        char *data = gtfs_read_file(recovered, fl, 600, 7);
+        ok = ok && data != NULL && data[0] == 0;
+        delete[] data;
+        data = gtfs_read_file(recovered, fl, 700, 7);
+        ok = ok && data != NULL && data[0] == 0;
+        delete[] data;
+        gtfs_close_file(recovered, fl);
+    }
+    ok = ok && !std::filesystem::exists(directory + "/test25_gone.txt");
+
+    ok ? cout << PASS : cout << FAIL;
+    for (int f = 0; f < num_files; f++) {
+        gtfs_close_file(gtfs, files[f]);
+    }
+}
+
+// Test 26
+// Recovery skips the synced writes a data file's applied marker covers: every write of a
+// file synced at each commit, and the writes of a GTFS_SYNC_FLUSH file up to a checkpoint
+void test_applied_markers() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_clean(gtfs);
+    file_t *strict = gtfs_open_file(gtfs, "test26_strict.txt", 1000);
+    file_t *lazy = gtfs_open_file(gtfs, "test26_lazy.txt", 1000, GTFS_SYNC_FLUSH);
+    bool ok = true;
+    for (int i = 0; i < 20; i++) {
+        string str = "w" + to_string(i);
+        str.resize(8, '.');
+        ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, strict, (i % 10) * 8, 8, str.c_str())) == 8;
+        ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, lazy, (i % 10) * 8, 8, str.c_str())) == 8;
+        if (i == 9) {
+            ok = ok && gtfs_checkpoint(gtfs) == 0;
+        }
+    }
+    flush_log_file(gtfs);
+    ok = ok && std::filesystem::exists(directory + "/" APPLIED_DIR "/test26_strict.txt");
+
+    // The log holds the last ten writes of each file
+    gtfs_t *recovered = gtfs_init(directory, verbose);
+    gtfs_recovery_stats_t stats;
+    ok = ok && gtfs_get_recovery_stats(recovered, &stats) == 0;
+    cout << "Replayed " << stats.writes_replayed << " writes, skipped " << stats.writes_skipped << "\n";
+    ok = ok && stats.writes_skipped == 10 && stats.writes_replayed == 10;
+
+    for (string filename : {"test26_strict.txt", "test26_lazy.txt"}) {
+        file_t *fl = gtfs_open_file(recovered, filename, 1000);
+        for (int i = 10; i < 20; i++) {
+            string str = "w" + to_string(i);
+            str.resize(8, '.');
+            char *data = gtfs_read_file(recovered, fl, (i % 10) * 8, 8);
+            ok = ok && data != NULL && string(data) == str;
+            delete[] data;
+        }
+        gtfs_close_file(recovered, fl);
+    }
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, strict);
+    gtfs_close_file(gtfs, lazy);
+}
+
+// Test 27
+// Recovery parses the mapped log in place: records before a torn tail are replayed, and the
+// parse stops exactly where the last good record ends
+void test_mapped_log_parser() {
+
+    bool ok = log_crc32(0, "123456789", 9) == 0xCBF43926u;
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_clean(gtfs);
+    string filename = "test27.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+    for (int i = 0; i < 100; i++) {
+        string str = "w" + to_string(i);
+        str.resize(10, '.');
+        ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, (i % 10) * 10, 10, str.c_str())) == 10;
+    }
+    flush_log_file(gtfs);
+    string log_path = directory + "/gtfs_log";
+    uintmax_t good_bytes = std::filesystem::file_size(log_path);
+
+    // A record cut short by the crash, after a copy of the last good bytes
+    ifstream log_in(log_path, ios::binary);
+    string head(40, '\0');
+    log_in.read(&head[0], head.size());
+    log_in.close();
+    ofstream log_out(log_path, ios::binary | ios::app);
+    log_out.write(head.data(), head.size());
+    log_out.close();
+
+    gtfs_t *recovered = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_recovery_stats_t stats;
+    ok = ok && gtfs_get_recovery_stats(recovered, &stats) == 0;
+    cout << "Parsed " << stats.log_records << " records, " << stats.log_bytes << " of " << good_bytes << " bytes\n";
+    ok = ok && stats.log_bytes == good_bytes && stats.log_records == 200 && stats.writes_replayed == 100;
+
+    file_t *rfl = gtfs_open_file(recovered, filename, 1000);
+    for (int i = 90; i < 100; i++) {
+        string str = "w" + to_string(i);
+        str.resize(10, '.');
+        char *data = gtfs_read_file(recovered, rfl, (i % 10) * 10, 10);
+        ok = ok && data != NULL && string(data) == str;
+        delete[] data;
+    }
+    gtfs_close_file(recovered, rfl);
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// Test 28
+// Creating and growing files writes no zeros: a large file stays sparse unless it asks
+// for preallocation, and reads of the new range still return zeros
+void test_sparse_open() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    bool ok = true;
+    const int large = 1 << 30;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    file_t *sparse = gtfs_open_file(gtfs, "test28_sparse.txt", large);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "Opened a " << large << " byte file in " << ms << " ms\n";
+    struct stat sb;
+    ok = ok && sparse != NULL && stat((directory + "/test28_sparse.txt").c_str(), &sb) == 0;
+    ok = ok && sb.st_size == large && (long long)sb.st_blocks * 512 < large / 16;
+    char *data = gtfs_read_file(gtfs, sparse, large - 100, 100);
+    ok = ok && data != NULL && data[0] == 0 && data[99] == 0;
+    delete[] data;
+
+    // Growing on reopen keeps what was written
+    const int small = 64 * 1024;
+    file_t *reserved = gtfs_open_file(gtfs, "test28_reserved.txt", small, GTFS_SYNC_DEFAULT, GTFS_OPEN_PREALLOCATE);
+    ok = ok && reserved != NULL && gtfs_sync_write_file(gtfs_write_file(gtfs, reserved, 0, 4, "kept")) == 4;
+    gtfs_close_file(gtfs, reserved);
+    reserved = gtfs_open_file(gtfs, "test28_reserved.txt", 4 * small, GTFS_SYNC_DEFAULT, GTFS_OPEN_PREALLOCATE);
+    ok = ok && reserved != NULL && stat((directory + "/test28_reserved.txt").c_str(), &sb) == 0;
+    ok = ok && sb.st_size == 4 * small && (long long)sb.st_blocks * 512 >= 4 * small;
+    data = gtfs_read_file(gtfs, reserved, 0, 4);
+    ok = ok && data != NULL && string(data, 4) == "kept";
+    delete[] data;
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, sparse);
+    gtfs_close_file(gtfs, reserved);
+    gtfs_remove_file(gtfs, sparse);
+    gtfs_remove_file(gtfs, reserved);
+}
+
+// Test 29
+// The directory catalog: files already on disk are found without creating them, the limit
+// on files per directory holds, and removing a file makes room again
+void test_directory_catalog() {
+
+    string dir = directory + "/test29";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+    ofstream(dir + "/existing.txt") << "0123456789";
+
+    gtfs_t *gtfs = gtfs_init(dir, verbose);
+    bool ok = true;
+    file_t *existing = gtfs_open_file(gtfs, "existing.txt", 20);
+    char *data = gtfs_read_file(gtfs, existing, 0, 10);
+    ok = ok && data != NULL && string(data) == "0123456789";
+    delete[] data;
+    gtfs_close_file(gtfs, existing);
+
+    // Only the log's own names are reserved
+    ofstream(dir + "/gtfs_log_notes.txt") << "notes";
+    gtfs_t *rescanned = gtfs_init(dir, verbose);
+    file_t *notes = gtfs_open_file(rescanned, "gtfs_log_notes.txt", 5);
+    data = gtfs_read_file(rescanned, notes, 0, 5);
+    ok = ok && data != NULL && string(data) == "notes";
+    delete[] data;
+    ok = ok && gtfs_close_file(rescanned, notes) == 0 && gtfs_remove_file(rescanned, notes) == 0;
+    ok = ok && gtfs_open_file(rescanned, "gtfs_log.manifest", 16) == NULL;
+    ok = ok && gtfs_open_file(rescanned, "gtfs_log.000001", 16) == NULL;
+
+    // A new file that cannot be sized is not left behind
+    ok = ok && gtfs_open_file(rescanned, "too_big.txt", (gtfs_off_t)1 << 62) == NULL;
+    ok = ok && !std::filesystem::exists(dir + "/too_big.txt");
+    gtfs = rescanned;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 1; i < MAX_NUM_FILES_PER_DIR; i++) {
+        file_t *fl = gtfs_open_file(gtfs, "file" + to_string(i) + ".txt", 16);
+        ok = ok && fl != NULL && gtfs_close_file(gtfs, fl) == 0;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "Created " << MAX_NUM_FILES_PER_DIR - 1 << " files in " << ms << " ms\n";
+    ok = ok && gtfs_open_file(gtfs, "one_too_many.txt", 16) == NULL;
+
+    file_t *fl = gtfs_open_file(gtfs, "file1.txt", 16);
+    ok = ok && fl != NULL && gtfs_close_file(gtfs, fl) == 0 && gtfs_remove_file(gtfs, fl) == 0;
+    fl = gtfs_open_file(gtfs, "one_too_many.txt", 16);
+    ok = ok && fl != NULL;
+    gtfs_close_file(gtfs, fl);
+
+    ok ? cout << PASS : cout << FAIL;
+    std::filesystem::remove_all(dir);
+}
+
+// Test 30
+// Offsets and lengths past 4 GB: a write larger than one I/O chunk lands at a 64-bit offset
+// of a sparse file, reads back through both the blocking path and the I/O engine, and a
+// write near the end of the file is rebuilt by recovery
+void test_large_offsets() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_clean(gtfs);
+    string filename = "test30.txt";
+    const gtfs_off_t file_length = (gtfs_off_t)5 << 30;
+    const gtfs_off_t offset = ((gtfs_off_t)4 << 30) + 12345;
+    const gtfs_off_t length = GTFS_IO_CHUNK + GTFS_IO_CHUNK / 2;
+    file_t *fl = gtfs_open_file(gtfs, filename, file_length, GTFS_SYNC_FLUSH);
+    bool ok = fl != NULL;
+
+    unique_ptr<char[]> payload(new char[length]);
+    for (gtfs_off_t i = 0; i < length; i++) {
+        payload[i] = 'a' + (i * 7 + i / 4096) % 26;
+    }
+    vector<char> expected(payload.get(), payload.get() + length);
+    ok = ok && gtfs_sync_write_file(gtfs_write_file_owned(gtfs, fl, offset, length, std::move(payload))) == length;
+
+    vector<char> buf(length);
+    ok = ok && gtfs_read_file_into(gtfs, fl, offset, length, buf.data()) == length && buf == expected;
+    gtfs_set_io_engine(gtfs, GTFS_IO_THREADS, 4);
+    std::fill(buf.begin(), buf.end(), 0);
+    ok = ok && gtfs_read_file_into(gtfs, fl, offset, length, buf.data()) == length && buf == expected;
+
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, file_length - 8, 8, "tail-end")) == 8;
+    flush_log_file(gtfs);
+
+    // Spoil the tail in the data file: recovery has to rebuild it from the log
+    {
+        fstream data_file(directory + "/" + filename, ios::in | ios::out | ios::binary);
+        data_file.seekp(file_length - 8);
+        data_file.write("\0\0\0\0\0\0\0\0", 8);
+    }
+    gtfs_t *recovered = gtfs_init(directory, verbose);
+    file_t *reopened = gtfs_open_file(recovered, filename, file_length);
+    char *data = gtfs_read_file(recovered, reopened, file_length - 8, 8);
+    ok = ok && data != NULL && string(data) == "tail-end";
+    delete[] data;
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+    gtfs_close_file(recovered, reopened);
+    gtfs_remove_file(recovered, reopened);
+    gtfs_clean(recovered);
+}
+
+// Test 31
+// The block cache: a repeated read is served from cached blocks, a sync updates them in
+// place, pending writes still show through, and a hot block survives a long one-off scan
+void test_block_cache() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_set_block_cache(gtfs, 16 * CACHE_BLOCK_BYTES);
+    string filename = "test31.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 512 * CACHE_BLOCK_BYTES);
+    bool ok = gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 100, 5, "first")) == 5;
+    gtfs_cache_stats_t before, after;
+
+    auto read_equals = [&](gtfs_off_t offset, string expected) {
+        char *data = gtfs_read_file(gtfs, fl, offset, expected.length());
+        bool same = data != NULL && string(data, expected.length()) == expected;
+        delete[] data;
+        return same;
+    };
+    ok = ok && read_equals(100, "first");
+    gtfs_get_cache_stats(gtfs, &before);
+    ok = ok && read_equals(100, "first");
+    gtfs_get_cache_stats(gtfs, &after);
+    ok = ok && after.hits == before.hits + 1 && after.misses == before.misses;
+
+    // The sync patches the cached block, a pending write is overlaid on it
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 100, 6, "second")) == 6;
+    ok = ok && read_equals(100, "second");
+    write_t *pending = gtfs_write_file(gtfs, fl, 102, 2, "XY");
+    ok = ok && read_equals(100, "seXYnd");
+    gtfs_abort_write_file(pending);
+    ok = ok && read_equals(100, "second");
+    gtfs_get_cache_stats(gtfs, &after);
+    ok = ok && after.misses == before.misses;
+
+    // Block 0 turns hot once it is read again after falling out of probation, then a scan
+    // of every other block does not evict it
+    for (int block = 1; block < 20; block++) {
+        ok = ok && read_equals(block * CACHE_BLOCK_BYTES, string(1, '\0'));
+    }
+    ok = ok && read_equals(100, "second");
+    for (int block = 20; block < 512; block++) {
+        ok = ok && read_equals(block * CACHE_BLOCK_BYTES, string(1, '\0'));
+    }
+    gtfs_get_cache_stats(gtfs, &before);
+    ok = ok && read_equals(100, "second");
+    gtfs_get_cache_stats(gtfs, &after);
+    cout << "Hits " << after.hits << ", misses " << after.misses << ", evictions " << after.evictions
+         << ", hit rate " << 100.0 * after.hits / (after.hits + after.misses) << "%\n";
+    ok = ok && after.hits == before.hits + 1 && after.blocks_cached <= 16 && after.evictions > 0;
+
+    gtfs_set_block_cache(gtfs, 0);
+    gtfs_get_cache_stats(gtfs, &after);
+    ok = ok && after.blocks_cached == 0 && read_equals(100, "second");
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+}
+
+// Test 32
+// Read-ahead: small reads in file order are detected as a stream and prefetched in growing
+// windows, while reads at scattered offsets prefetch nothing
+void test_readahead() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test32.txt";
+    const gtfs_off_t file_length = 4 << 20;
+    file_t *fl = gtfs_open_file(gtfs, filename, file_length);
+    unique_ptr<char[]> payload(new char[file_length]);
+    for (gtfs_off_t i = 0; i < file_length; i++) {
+        payload[i] = 'a' + (i / 4096 + i) % 26;
+    }
+    vector<char> expected(payload.get(), payload.get() + file_length);
+    bool ok = gtfs_sync_write_file(gtfs_write_file_owned(gtfs, fl, 0, file_length, std::move(payload))) == file_length;
+
+    gtfs_cache_stats_t before, after;
+    gtfs_get_cache_stats(gtfs, &before);
+    char buf[4096];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (gtfs_off_t offset = 0; offset < file_length; offset += sizeof(buf)) {
+        ok = ok && gtfs_read_file_into(gtfs, fl, offset, sizeof(buf), buf) == (gtfs_off_t)sizeof(buf);
+        ok = ok && memcmp(buf, expected.data() + offset, sizeof(buf)) == 0;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    gtfs_get_cache_stats(gtfs, &after);
+    cout << "Sequential scan in " << ms << " ms, " << after.readahead_calls - before.readahead_calls
+         << " prefetches of " << after.readahead_bytes - before.readahead_bytes << " bytes\n";
+    ok = ok && after.readahead_calls - before.readahead_calls > 1;
+    ok = ok && after.readahead_bytes - before.readahead_bytes > READAHEAD_MIN_BYTES;
+
+    // Scattered reads, each far from where the last one ended
+    gtfs_get_cache_stats(gtfs, &before);
+    for (int i = 0; i < 64; i++) {
+        gtfs_off_t offset = ((gtfs_off_t)i * 7919 * 4096) % (file_length - sizeof(buf));
+        ok = ok && gtfs_read_file_into(gtfs, fl, offset, sizeof(buf), buf) == (gtfs_off_t)sizeof(buf);
+        ok = ok && memcmp(buf, expected.data() + offset, sizeof(buf)) == 0;
+    }
+    gtfs_get_cache_stats(gtfs, &after);
+    ok = ok && after.readahead_calls == before.readahead_calls;
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+}
+
+// Test 33
+// Scatter-gather: gtfs_writev logs its ranges as one record and syncs or aborts them through
+// one handle, gtfs_readv fills several buffers at once, and recovery replays the ranges
+void test_scatter_gather() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_clean(gtfs);
+    string filename = "test33.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 4096, GTFS_SYNC_FLUSH);
+    char alpha[] = "alpha", beta[] = "beta", gamma[] = "gamma", junk[] = "junk";
+    gtfs_iovec_t ranges[3] = {{0, 5, alpha}, {100, 4, beta}, {104, 5, gamma}};
+    write_t *wrt = gtfs_writev(gtfs, fl, ranges, 3);
+    bool ok = wrt != NULL;
+
+    char bufs[3][8];
+    auto read_back = [&](gtfs_t *g, file_t *f) {
+        memset(bufs, 0, sizeof(bufs));
+        gtfs_iovec_t out[3] = {{0, 5, bufs[0]}, {100, 4, bufs[1]}, {104, 5, bufs[2]}};
+        return gtfs_readv(g, f, out, 3) == 14 && string(bufs[0]) == "alpha" && string(bufs[1]) == "beta" &&
+               string(bufs[2]) == "gamma";
+    };
+    ok = ok && read_back(gtfs, fl);
+    ok = ok && gtfs_sync_write_file(wrt) == 14;
+    ok = ok && read_back(gtfs, fl);
+
+    // Aborting the handle discards every range
+    gtfs_iovec_t discarded[2] = {{0, 4, junk}, {104, 4, junk}};
+    wrt = gtfs_writev(gtfs, fl, discarded, 2);
+    ok = ok && wrt != NULL && gtfs_abort_write_file(wrt) == 0;
+    ok = ok && read_back(gtfs, fl);
+    flush_log_file(gtfs);
+
+    // Spoil the data file: recovery has to rebuild it from the 'V' record
+    {
+        fstream data_file(directory + "/" + filename, ios::in | ios::out | ios::binary);
+        data_file.write(string(200, '\0').data(), 200);
+    }
+    gtfs_t *recovered = gtfs_init(directory, verbose);
+    gtfs_recovery_stats_t stats;
+    ok = ok && gtfs_get_recovery_stats(recovered, &stats) == 0;
+    cout << "Recovered " << stats.log_records << " records, replayed " << stats.writes_replayed << " writes\n";
+    ok = ok && stats.log_records == 7 && stats.writes_replayed == 3 && stats.writes_discarded == 2;
+    file_t *reopened = gtfs_open_file(recovered, filename, 4096);
+    ok = ok && read_back(recovered, reopened);
+    gtfs_set_io_engine(recovered, GTFS_IO_THREADS, 4);
+    ok = ok && read_back(recovered, reopened);
+
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+    gtfs_close_file(recovered, reopened);
+    gtfs_remove_file(recovered, reopened);
+    gtfs_clean(recovered);
+}
+
+// Test 34
+// Checkpoints taken while other threads sync. A sync whose 'S' record is durable must be
+// applied before the old log goes, or its write would be carried as a bare 'W' record and
+// discarded by recovery. Each round ends on a checkpoint with syncs in flight, then recovers.
+// Runs with group commit and then with the log writer.
+void test_checkpoint_concurrent_syncs() {
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+    gtfs_clean(gtfs);
+    const int num_threads = 4;
+    const int num_rounds = 10;
+    vector<file_t*> files;
+    for (int t = 0; t < num_threads; t++) {
+        files.push_back(gtfs_open_file(gtfs, "test34_" + to_string(t) + ".txt", 1000, GTFS_SYNC_FDATASYNC));
+    }
+    bool ok = true;
+
+    for (int round = 0; round < 2 * num_rounds; round++) {
+        if (round == num_rounds) {
+            gtfs_start_log_writer(gtfs, 64);
+        }
+        atomic<bool> stop{false};
+        atomic<bool> syncs_ok{true};
+        vector<int> last(num_threads, -1);
+        vector<thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; !stop.load() || i < 20; i++) {
+                    string str = "r" + to_string(round) + "s" + to_string(i);
+                    str.resize(8, '.');
+                    write_t *wrt = gtfs_write_file(gtfs, files[t], (i % 10) * 8, 8, str.c_str());
+                    if (wrt == NULL || gtfs_sync_write_file(wrt) != 8) {
+                        syncs_ok = false;
+                    }
+                    last[t] = i;
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        ok = ok && gtfs_checkpoint(gtfs) == 0;
+        stop = true;
+        for (auto &th : threads) {
+            th.join();
+        }
+        ok = ok && syncs_ok.load();
+        flush_log_file(gtfs);
+
+        gtfs_t *recovered = gtfs_init(directory, verbose, GTFS_SYNC_FLUSH);
+        gtfs_recovery_stats_t stats;
+        ok = ok && gtfs_get_recovery_stats(recovered, &stats) == 0 && stats.writes_discarded == 0;
+        for (int t = 0; t < num_threads; t++) {
+            file_t *rfl = gtfs_open_file(recovered, "test34_" + to_string(t) + ".txt", 1000);
+            for (int i = last[t] - 9; i <= last[t]; i++) {
+                char *data = gtfs_read_file(recovered, rfl, (i % 10) * 8, 8);
+                string str = "r" + to_string(round) + "s" + to_string(i);
+                str.resize(8, '.');
+                ok = ok && data != NULL && string(data) == str;
+                delete[] data;
+            }
+            gtfs_close_file(recovered, rfl);
+        }
+    }
+    gtfs_stop_log_writer(gtfs);
+
+    ok ? cout << PASS : cout << FAIL;
+    for (file_t *fl : files) {
+        gtfs_close_file(gtfs, fl);
+    }
+}
 
 int main(int argc, char **argv) {
     if (argc < 2)
@@ -518,4 +1692,96 @@ int main(int argc, char **argv) {
     cout << "================== Custom test - Test 11 ==================\n";
     cout << "Testing open file with larger size and smaller\n";
     test_open_file_size();
+
+    cout << "================== Custom test - Test 12 ==================\n";
+    cout << "Testing none / flush / fdatasync / O_DSYNC durability policies\n";
+    test_durability_policies();
+
+    cout << "================== Custom test - Test 13 ==================\n";
+    cout << "Testing that newer pending writes win where they overlap\n";
+    test_overlapping_pending_writes();
+
+    cout << "================== Custom test - Test 14 ==================\n";
+    cout << "Testing range reads into a caller buffer\n";
+    test_read_into_buffer();
+
+    cout << "================== Custom test - Test 15 ==================\n";
+    cout << "Testing zero-copy read views on memory-mapped files\n";
+    test_mmap_read_view();
+
+    cout << "================== Custom test - Test 16 ==================\n";
+    cout << "Testing writes that take ownership of the caller's buffer\n";
+    test_write_owned_buffer();
+
+    cout << "================== Custom test - Test 17 ==================\n";
+    cout << "Testing that write pools recycle synced and aborted writes\n";
+    test_write_pool_recycling();
+
+    cout << "================== Custom test - Test 18 ==================\n";
+    cout << "Testing concurrent readers and writers on private and shared files\n";
+    test_concurrent_stress();
+
+    cout << "================== Custom test - Test 19 ==================\n";
+    cout << "Testing asynchronous writes through the background log writer\n";
+    test_async_log_writer();
+
+    cout << "================== Custom test - Test 20 ==================\n";
+    cout << "Testing io_uring, worker thread and blocking I/O engines\n";
+    test_io_engines();
+
+    cout << "================== Custom test - Test 21 ==================\n";
+    cout << "Testing batched syncs across files\n";
+    test_sync_write_batch();
+
+    cout << "================== Custom test - Test 22 ==================\n";
+    cout << "Testing per-write aborts and coalescing of writes synced together\n";
+    test_coalesce_pending_writes();
+
+    cout << "================== Custom test - Test 23 ==================\n";
+    cout << "Testing checkpoints that carry pending writes into a fresh log\n";
+    test_checkpoint();
+
+    cout << "================== Custom test - Test 24 ==================\n";
+    cout << "Testing the segmented log with rotation and recycling\n";
+    test_log_segments();
+
+    cout << "================== Custom test - Test 25 ==================\n";
+    cout << "Testing two-phase recovery that replays files in parallel\n";
+    test_parallel_recovery();
+
+    cout << "================== Custom test - Test 26 ==================\n";
+    cout << "Testing applied markers that let recovery skip writes already in the data files\n";
+    test_applied_markers();
+
+    cout << "================== Custom test - Test 27 ==================\n";
+    cout << "Testing the mapped log parser against a torn tail\n";
+    test_mapped_log_parser();
+
+    cout << "================== Custom test - Test 28 ==================\n";
+    cout << "Testing sparse and preallocated file creation\n";
+    test_sparse_open();
+
+    cout << "================== Custom test - Test 29 ==================\n";
+    cout << "Testing the in-memory directory catalog\n";
+    test_directory_catalog();
+
+    cout << "================== Custom test - Test 30 ==================\n";
+    cout << "Testing 64-bit offsets and chunked I/O on a file larger than 4 GB\n";
+    test_large_offsets();
+
+    cout << "================== Custom test - Test 31 ==================\n";
+    cout << "Testing the block cache with 2Q eviction\n";
+    test_block_cache();
+
+    cout << "================== Custom test - Test 32 ==================\n";
+    cout << "Testing sequential read-ahead detection\n";
+    test_readahead();
+
+    cout << "================== Custom test - Test 33 ==================\n";
+    cout << "Testing scatter-gather gtfs_writev and gtfs_readv\n";
+    test_scatter_gather();
+
+    cout << "================== Custom test - Test 34 ==================\n";
+    cout << "Testing checkpoints taken while other threads sync\n";
+    test_checkpoint_concurrent_syncs();
 }